@@ -31,42 +31,69 @@ THE SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 
-#include "redis.h"
+#include "ngx_limiter_core.h"
 
 struct ngx_http_limiter_srv_conf_s {
-    // redis config
-    ngx_str_t host;
-    ngx_str_t port;
-    ngx_str_t pass;
-    ngx_uint_t db;
+    // redis and limit config
+    ngx_limiter_conf_t limiter;
+};
+
+struct ngx_http_limiter_loc_conf_s {
+    // limiter enabled for this location
+    ngx_flag_t enable;
+
+    // requests over limiter maximum held for the next window instead of rejected
+    ngx_uint_t burst;
+
+    // gap between held requests, 0 spreads limiter maximum over limiter expired
+    ngx_msec_t delay;
+};
+
+struct ngx_http_limiter_ctx_s {
+    ngx_http_request_t* request;
+
+    // hit of the request, shared with the other lookups of the same key
+    ngx_limiter_waiter_t waiter;
 
-    // limiter maximum
-    ngx_uint_t max;
+    // lookup pending in redis
+    ngx_uint_t waiting;
 
-    // limit expired in seconds
-    ngx_uint_t limit_expired;
+    // request already counted, set before it is delayed
+    ngx_uint_t limited;
 };
 
 typedef struct ngx_http_limiter_srv_conf_s ngx_http_limiter_srv_conf_t;
+typedef struct ngx_http_limiter_loc_conf_s ngx_http_limiter_loc_conf_t;
+typedef struct ngx_http_limiter_ctx_s ngx_http_limiter_ctx_t;
 
 static void* ngx_http_limiter_create_srv_conf(ngx_conf_t* cf);
 static char* ngx_http_limiter_merge_srv_conf(ngx_conf_t* cf, void* parent, void* child);
+static void* ngx_http_limiter_create_loc_conf(ngx_conf_t* cf);
+static char* ngx_http_limiter_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child);
 
 static char* ngx_http_limiter(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+static char* ngx_http_limiter_status(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
 static ngx_int_t ngx_http_limiter_handler(ngx_http_request_t* r);
+static ngx_int_t ngx_http_limiter_log_handler(ngx_http_request_t* r);
+static ngx_int_t ngx_http_limiter_content_handler(ngx_http_request_t* r);
+static ngx_int_t ngx_http_limiter_status_handler(ngx_http_request_t* r);
+static ngx_int_t ngx_http_limiter_send_response(ngx_http_request_t* r,
+    ngx_uint_t status, ngx_uint_t success, char* data);
+static void ngx_http_limiter_wake(ngx_limiter_waiter_t* w);
+static void ngx_http_limiter_cleanup(void* data);
+static ngx_http_limiter_ctx_t* ngx_http_limiter_get_ctx(ngx_http_request_t* r);
+static void ngx_http_limiter_delay(ngx_http_request_t* r);
 static ngx_int_t ngx_http_limiter_preconf(ngx_conf_t *cf);
 static ngx_int_t ngx_http_limiter_postconf(ngx_conf_t *cf);
 
-static void on_auth_success(void*);
-
 // module directive
 static ngx_command_t ngx_http_limiter_commands[] = {
     {
         ngx_string("limiter"), // directive
-        NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+        NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
 
         ngx_http_limiter, // configuration setup function
-        0,
+        NGX_HTTP_LOC_CONF_OFFSET,
         0,
         NULL,
     },
@@ -76,7 +103,7 @@ static ngx_command_t ngx_http_limiter_commands[] = {
 
         ngx_conf_set_str_slot, // configuration setup function
         NGX_HTTP_SRV_CONF_OFFSET,
-        offsetof(ngx_http_limiter_srv_conf_t, host),
+        offsetof(ngx_http_limiter_srv_conf_t, limiter.host),
         NULL,
     },
     {
@@ -85,7 +112,7 @@ static ngx_command_t ngx_http_limiter_commands[] = {
 
         ngx_conf_set_str_slot, // configuration setup function
         NGX_HTTP_SRV_CONF_OFFSET,
-        offsetof(ngx_http_limiter_srv_conf_t, port),
+        offsetof(ngx_http_limiter_srv_conf_t, limiter.port),
         NULL,
     },
     {
@@ -94,7 +121,7 @@ static ngx_command_t ngx_http_limiter_commands[] = {
 
         ngx_conf_set_str_slot, // configuration setup function
         NGX_HTTP_SRV_CONF_OFFSET,
-        offsetof(ngx_http_limiter_srv_conf_t, pass),
+        offsetof(ngx_http_limiter_srv_conf_t, limiter.pass),
         NULL,
     },
     {
@@ -103,7 +130,25 @@ static ngx_command_t ngx_http_limiter_commands[] = {
 
         ngx_conf_set_num_slot, // configuration setup function
         NGX_HTTP_SRV_CONF_OFFSET,
-        offsetof(ngx_http_limiter_srv_conf_t, db),
+        offsetof(ngx_http_limiter_srv_conf_t, limiter.db),
+        NULL,
+    },
+    {
+        ngx_string("limiter_key_prefix"), // directive
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_str_slot, // configuration setup function
+        NGX_HTTP_SRV_CONF_OFFSET,
+        offsetof(ngx_http_limiter_srv_conf_t, limiter.prefix),
+        NULL,
+    },
+    {
+        ngx_string("limiter_redis_timeout"), // directive
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_msec_slot, // configuration setup function
+        NGX_HTTP_SRV_CONF_OFFSET,
+        offsetof(ngx_http_limiter_srv_conf_t, limiter.timeout),
         NULL,
     },
     {
@@ -112,7 +157,7 @@ static ngx_command_t ngx_http_limiter_commands[] = {
 
         ngx_conf_set_num_slot, // configuration setup function
         NGX_HTTP_SRV_CONF_OFFSET,
-        offsetof(ngx_http_limiter_srv_conf_t, max),
+        offsetof(ngx_http_limiter_srv_conf_t, limiter.max),
         NULL,
     },
 
@@ -122,7 +167,43 @@ static ngx_command_t ngx_http_limiter_commands[] = {
 
         ngx_conf_set_num_slot, // configuration setup function
         NGX_HTTP_SRV_CONF_OFFSET,
-        offsetof(ngx_http_limiter_srv_conf_t, limit_expired),
+        offsetof(ngx_http_limiter_srv_conf_t, limiter.limit_expired),
+        NULL,
+    },
+    {
+        ngx_string("limiter_lease"), // directive
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_limiter_conf_set_lease, // configuration setup function
+        NGX_HTTP_SRV_CONF_OFFSET,
+        offsetof(ngx_http_limiter_srv_conf_t, limiter),
+        NULL,
+    },
+    {
+        ngx_string("limiter_adaptive_zone"), // directive
+        NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+
+        ngx_limiter_conf_set_adaptive_zone, // configuration setup function
+        0,
+        0,
+        NULL,
+    },
+    {
+        ngx_string("limiter_adaptive"), // directive
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_limiter_conf_set_adaptive, // configuration setup function
+        NGX_HTTP_SRV_CONF_OFFSET,
+        offsetof(ngx_http_limiter_srv_conf_t, limiter),
+        NULL,
+    },
+    {
+        ngx_string("limiter_status"), // directive
+        NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+
+        ngx_http_limiter_status, // configuration setup function
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
         NULL,
     },
     ngx_null_command // command termination
@@ -139,8 +220,8 @@ static ngx_http_module_t ngx_http_limiter_ctx = {
     ngx_http_limiter_create_srv_conf, // create server config
     ngx_http_limiter_merge_srv_conf, // merge server config
 
-    NULL, // create location config
-    NULL, // merge location config
+    ngx_http_limiter_create_loc_conf, // create location config
+    ngx_http_limiter_merge_loc_conf, // merge location config
 };
 
 // module definition
@@ -159,232 +240,451 @@ ngx_module_t ngx_http_limiter_module = {
     NGX_MODULE_V1_PADDING
 };
 
-// http handler
+// preaccess phase handler
 static ngx_int_t ngx_http_limiter_handler(ngx_http_request_t* r) {
+    ngx_int_t rc;
+    ngx_uint_t excess;
+    ngx_msec_t delay, window;
 
-    ngx_buf_t* buf;
-    ngx_chain_t out;
-
+    ngx_pool_cleanup_t* cln;
+    ngx_http_limiter_ctx_t* ctx;
     ngx_http_limiter_srv_conf_t* limiter_srv_conf;
+    ngx_http_limiter_loc_conf_t* limiter_loc_conf;
+
+    limiter_loc_conf = ngx_http_get_module_loc_conf(r, ngx_http_limiter_module);
+    if (!limiter_loc_conf->enable || r != r->main) {
+        return NGX_DECLINED;
+    }
 
     // get limiter server conf
     limiter_srv_conf = ngx_http_get_module_srv_conf(r, ngx_http_limiter_module);
-    printf("limiter_srv_conf host: %s\n", (const char*) limiter_srv_conf->host.data);
-    printf("limiter_srv_conf port: %s\n", (const char*) limiter_srv_conf->port.data);
-    printf("limiter_srv_conf pass: %s\n", (const char*) limiter_srv_conf->pass.data);
-    printf("limiter_srv_conf db: %ld\n", limiter_srv_conf->db);
-    printf("limiter_srv_conf max: %ld\n", limiter_srv_conf->max);
-    printf("limiter_srv_conf expired: %ld\n", limiter_srv_conf->limit_expired);
 
-    // get user agent
-    ngx_str_t user_agent = r->headers_in.user_agent->value;
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, (const char*) user_agent.data);
-    printf("user-agent: %s\n", user_agent.data);
-    printf("user-agent-len: %ld\n", user_agent.len);
+    ctx = ngx_http_limiter_get_ctx(r);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->pool, sizeof(*ctx));
+        if (ctx == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_limiter_module);
 
-    printf("x_forwarded_for N: %ld\n", r->headers_in.x_forwarded_for.nelts);
+        // a request closed while waiting leaves the lookup
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
 
-    char client_ipstr[INET_ADDRSTRLEN];
-    inet_ntop(r->connection->sockaddr->sa_family, r->connection->sockaddr, 
-        client_ipstr, sizeof(client_ipstr));
-    printf("user: %s\n", client_ipstr);
+        cln->handler = ngx_http_limiter_cleanup;
+        cln->data = ctx;
 
+        ctx->request = r;
+        ctx->waiter.burst = limiter_loc_conf->burst;
+        ctx->waiter.handler = ngx_http_limiter_wake;
+        ctx->waiter.data = ctx;
 
-    char content_type[17] = "application/json";
-    content_type[16] = 0x0;
+        rc = ngx_limiter_lookup(&limiter_srv_conf->limiter, &r->connection->addr_text,
+            &ctx->waiter, r->connection->log);
 
-    // set content type header
-    r->headers_out.content_type.len = sizeof(content_type) - 1;
-    r->headers_out.content_type.data = (u_char*) content_type;
+        if (rc == NGX_AGAIN) {
+            ctx->waiting = 1;
 
-    buf = ngx_palloc(r->pool, sizeof(ngx_buf_t));
+            // notice a client closing the connection while redis answers
+            if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
 
-    out.buf = buf;
-    out.next = NULL;
+            r->read_event_handler = ngx_http_test_reading;
+            r->write_event_handler = ngx_http_request_empty_handler;
 
-    // char* data = ngx_palloc(r->pool, sizeof(*data) * 6);
-    // if (data == NULL) {
-    //     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
-    //         "failed to allocate data response");
-    //     return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    // }
-
-    // redis
-    redis_t redis = redis_connect((char*) limiter_srv_conf->host.data, 
-        (char*) limiter_srv_conf->port.data, 
-        (char*) limiter_srv_conf->pass.data,
-        limiter_srv_conf->db, NULL, NULL, on_auth_success, NULL);
-    if (redis == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "redis init failed");
-
-        char* error_data = ngx_palloc(r->pool, sizeof(*error_data) * 15);
-        if (error_data == NULL) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
-                "failed to allocate error_data response");
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            return NGX_AGAIN;
         }
 
-        error_data = "internal error";
-        char base_resp_error[33] = "{\"success\": false, \"data\": \"\%s\"}";
-        char json_resp_error[45];
+        ctx->waiter.rc = rc;
+    }
+
+    // the phase is run again when the lookup completes or a delayed request wakes up
+    if (ctx->waiting) {
+        return NGX_AGAIN;
+    }
+
+    if (ctx->limited) {
+        return NGX_DECLINED;
+    }
+
+    rc = ctx->waiter.rc;
+    excess = ctx->waiter.excess;
 
-        sprintf(json_resp_error, base_resp_error, error_data);
-        json_resp_error[44] = 0x0;
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, ngx_http_limiter_send_response(r,
+            NGX_HTTP_INTERNAL_SERVER_ERROR, 0, "internal error"));
+        return NGX_DONE;
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+            "limiter: too many request from \"%V\"", &r->connection->addr_text);
+
+        ngx_http_finalize_request(r, ngx_http_limiter_send_response(r,
+            NGX_HTTP_TOO_MANY_REQUESTS, 0, "too many request, try again later"));
+        return NGX_DONE;
+    }
+
+    ctx->limited = 1;
+
+    if (excess == 0) {
+        return NGX_DECLINED;
+    }
 
-        buf->pos = (u_char*) json_resp_error; // first position in memory of the data
-        buf->last = (u_char*) json_resp_error + sizeof(json_resp_error) - 1; // last position in memory of the data
-        buf->memory = 1; // read only memory
-        buf->last_buf = 1; // will no more buffers in the request
+    // within burst, the request is counted against the next window: hold it
+    // until that window starts, then release the held requests spread over it
+    window = (ngx_msec_t) limiter_srv_conf->limiter.limit_expired * 1000;
 
-        r->headers_out.status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        r->headers_out.content_length_n = sizeof(json_resp_error) - 1;
+    delay = limiter_loc_conf->delay;
+    if (delay == 0) {
+        delay = window / ngx_limiter_max(&limiter_srv_conf->limiter);
+    }
+
+    delay = ngx_min(delay * (excess - 1), window - 1);
+    delay += ctx->waiter.wait;
 
-        ngx_http_send_header(r); // send headers
-        ngx_http_output_filter(r, &out);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "limiter: delaying request, excess: %ui, delay: %M", excess, delay);
+
+    if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    // printf("redis authenticated: %d\n", redis->authenticated);
-
-    // limiter
-
-    char base_get_command[6+sizeof(client_ipstr)] = "GET %s";
-    char get_command[sizeof(base_get_command)];
-
-    sprintf(get_command, base_get_command, client_ipstr);
-    get_command[sizeof(get_command)-1] = 0x0;
-    printf("get_command text length %ld \n", sizeof(get_command));
-    printf("get_command text %s\n", get_command);
-
-    // send set command
-    redis_reply_t get_reply = redis_send_command(redis, get_command);
-    if (get_reply == NULL) {
-        printf("redis_send_command error \n");
-    } else {
-        printf("---------------------------------------------------\n");
-        printf("redis get reply %s\n", get_reply->reply);
-        printf("redis get reply OK? %d\n", strcmp(REDIS_REPLY_GET_OK, get_reply->reply));
-        if (get_reply->reply_arr_size > 1) {
-            printf("redis get reply[0] %s\n", get_reply->reply_arr[0]);
-
-            int available_limit = atoi(get_reply->reply_arr[1]);
-            int max = (int) limiter_srv_conf->max;
-            printf("redis get reply[1] %d v %d\n", available_limit, max);
-
-            if (available_limit > max) {
-                printf("available_limit greater than %d\n", max);
-                redis_reply_free(get_reply);
-                redis_close(redis);
-
-                char* error_data = ngx_palloc(r->pool, sizeof(*error_data) * 34);
-                if (error_data == NULL) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
-                        "failed to allocate error_data response");
-                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-                }
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_limiter_delay;
 
-                error_data = "too many request, try again later";
-                char base_resp_error[33] = "{\"success\": false, \"data\": \"\%s\"}";
-                char json_resp_error[64];
+    r->connection->write->delayed = 1;
+    ngx_add_timer(r->connection->write, delay);
 
-                sprintf(json_resp_error, base_resp_error, error_data);
-                json_resp_error[63] = 0x0;
+    return NGX_AGAIN;
+}
+
+// log phase handler, feeds upstream response time and 5xx to the adaptive zone
+static ngx_int_t ngx_http_limiter_log_handler(ngx_http_request_t* r) {
+    ngx_msec_t latency;
+    ngx_http_upstream_state_t* state;
 
-                buf->pos = (u_char*) json_resp_error; // first position in memory of the data
-                buf->last = (u_char*) json_resp_error + sizeof(json_resp_error) - 1; // last position in memory of the data
-                buf->memory = 1; // read only memory
-                buf->last_buf = 1; // will no more buffers in the request
-                
-                r->headers_out.status = NGX_HTTP_TOO_MANY_REQUESTS;
-                r->headers_out.content_length_n = sizeof(json_resp_error) - 1;
+    ngx_http_limiter_ctx_t* ctx;
+    ngx_http_limiter_srv_conf_t* limiter_srv_conf;
 
-                ngx_http_send_header(r); // send headers
-                ngx_http_output_filter(r, &out);
-                return NGX_HTTP_TOO_MANY_REQUESTS;
+    // only requests the limiter let through
+    ctx = ngx_http_limiter_get_ctx(r);
+    if (ctx == NULL || !ctx->limited) {
+        return NGX_OK;
+    }
+
+    limiter_srv_conf = ngx_http_get_module_srv_conf(r, ngx_http_limiter_module);
+    if (limiter_srv_conf->limiter.adaptive == NULL) {
+        return NGX_OK;
+    }
+
+    // requests answered without an upstream say nothing about its health
+    if (r->upstream_states == NULL || r->upstream_states->nelts == 0) {
+        return NGX_OK;
+    }
+
+    state = r->upstream_states->elts;
+    latency = state[r->upstream_states->nelts - 1].response_time;
+
+    if (latency == (ngx_msec_t) -1) {
+        latency = NGX_CONF_UNSET_MSEC;
+    }
+
+    ngx_limiter_adaptive_sample(&limiter_srv_conf->limiter, latency,
+        r->headers_out.status >= NGX_HTTP_INTERNAL_SERVER_ERROR, r->connection->log);
+
+    return NGX_OK;
+}
+
+// lookup result arrived, run the phase again to apply it
+static void ngx_http_limiter_wake(ngx_limiter_waiter_t* w) {
+    ngx_connection_t* c;
+    ngx_http_request_t* r;
+    ngx_http_limiter_ctx_t* ctx;
+
+    ctx = w->data;
+    r = ctx->request;
+    c = r->connection;
+
+    ctx->waiting = 0;
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases(r);
+    ngx_http_run_posted_requests(c);
+}
+
+static void ngx_http_limiter_cleanup(void* data) {
+    ngx_http_limiter_ctx_t* ctx = data;
+
+    ngx_limiter_cancel(&ctx->waiter);
+}
+
+// internal redirects reset module contexts, the request is still counted
+// once through the ctx kept by its pool cleanup
+static ngx_http_limiter_ctx_t* ngx_http_limiter_get_ctx(ngx_http_request_t* r) {
+    ngx_pool_cleanup_t* cln;
+    ngx_http_limiter_ctx_t* ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_limiter_module);
+
+    if (ctx == NULL && (r->internal || r->filter_finalize)) {
+
+        for (cln = r->pool->cleanup; cln; cln = cln->next) {
+            if (cln->handler == ngx_http_limiter_cleanup) {
+                ctx = cln->data;
+                ngx_http_set_ctx(r, ctx, ngx_http_limiter_module);
+                break;
             }
         }
     }
 
-    //  too many requests
-    redis_reply_free(get_reply);
-
-    char base_incr_command[7+sizeof(client_ipstr)] = "INCR %s";
-    char incr_command[sizeof(base_incr_command)];
-
-    sprintf(incr_command, base_incr_command, client_ipstr);
-    incr_command[sizeof(incr_command)-1] = 0x0;
-    printf("incr_command text length %ld \n", sizeof(incr_command));
-    printf("incr_command text %s\n", incr_command);
-
-    // send set command
-    redis_reply_t incr_reply = redis_send_command(redis, incr_command);
-    if (incr_reply == NULL) {
-        printf("redis_send_command error \n");
-    } else {
-        printf("redis incr reply %s\n", incr_reply->reply);
-
-        // if incr command return 1, set expiry
-        if (strcmp(":1", incr_reply->reply) == 0) {
-            char base_expire_command[12+sizeof(client_ipstr)+2] = "EXPIRE %s %u";
-            char expire_command[sizeof(base_expire_command)];
-
-            unsigned char expire_in_seconds = (unsigned char) limiter_srv_conf->limit_expired;
-            sprintf(expire_command, base_expire_command, client_ipstr, expire_in_seconds);
-            expire_command[sizeof(expire_command)-1] = 0x0;
-            printf("expire_command text length %ld \n", sizeof(expire_command));
-            printf("expire_command text %s\n", expire_command);
-
-            // send set command
-            redis_reply_t expire_reply = redis_send_command(redis, expire_command);
-            if (expire_reply == NULL) {
-                printf("redis_send_command error \n");
-            } else {
-                printf("redis expire reply %s\n", expire_reply->reply);
-                printf("redis expire reply OK? %d\n", 
-                    strcmp(REDIS_REPLY_EXPIRE_OK, expire_reply->reply));
+    return ctx;
+}
+
+// resume a delayed request through the rest of the phases
+static void ngx_http_limiter_delay(ngx_http_request_t* r) {
+    ngx_event_t* wev;
+
+    wev = r->connection->write;
+
+    if (wev->delayed) {
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        return;
+    }
+
+    if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases(r);
+}
+
+// default content of a limiter location without its own content handler
+static ngx_int_t ngx_http_limiter_content_handler(ngx_http_request_t* r) {
+    return ngx_http_limiter_send_response(r, NGX_HTTP_OK, 1, "hello");
+}
+
+// effective limit and last interval of every adaptive zone
+static ngx_int_t ngx_http_limiter_status_handler(ngx_http_request_t* r) {
+    size_t size;
+    ngx_int_t rc;
+    ngx_buf_t* buf;
+    ngx_uint_t i, n, pass;
+    ngx_chain_t out;
+    ngx_list_part_t* part;
+    ngx_shm_zone_t* shm_zone;
+    ngx_limiter_adaptive_t* ctx;
+    ngx_limiter_adaptive_sh_t sh;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    size = sizeof("{\"success\": true, \"data\": []}") - 1;
+    buf = NULL;
+
+    // first pass sizes the buffer, second fills it
+    for (pass = 0; pass < 2; pass++) {
+
+        if (pass == 1) {
+            buf = ngx_create_temp_buf(r->pool, size);
+            if (buf == NULL) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "failed to allocate data response");
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
             }
 
-            redis_reply_free(expire_reply);
+            buf->last = ngx_sprintf(buf->last, "{\"success\": true, \"data\": [");
+        }
+
+        n = 0;
+        part = &((ngx_cycle_t*) ngx_cycle)->shared_memory.part;
+        shm_zone = part->elts;
+
+        for (i = 0; /* void */ ; i++) {
+
+            if (i >= part->nelts) {
+                if (part->next == NULL) {
+                    break;
+                }
+
+                part = part->next;
+                shm_zone = part->elts;
+                i = 0;
+            }
+
+            ctx = ngx_limiter_adaptive_zone(&shm_zone[i]);
+            if (ctx == NULL || ctx->sh == NULL) {
+                continue;
+            }
+
+            if (pass == 0) {
+                size += sizeof(", {\"zone\": \"\", \"limit\": , \"min\": , \"max\": , "
+                    "\"requests\": , \"errors\": , \"latency\": }") - 1
+                    + shm_zone[i].shm.name.len + 7 * NGX_INT_T_LEN;
+                continue;
+            }
+
+            ngx_shmtx_lock(&ctx->shpool->mutex);
+            sh = *ctx->sh;
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+            buf->last = ngx_sprintf(buf->last, "%s{\"zone\": \"%V\", \"limit\": %ui, "
+                "\"min\": %ui, \"max\": %ui, \"requests\": %ui, \"errors\": %ui, \"latency\": %M}",
+                n++ ? ", " : "", &shm_zone[i].shm.name, sh.limit, ctx->min, ctx->max,
+                sh.last_requests, sh.last_errors, sh.last_latency);
         }
     }
 
-    redis_reply_free(incr_reply);
+    buf->last = ngx_sprintf(buf->last, "]}");
+    buf->last_buf = 1;
+    buf->last_in_chain = 1;
 
-    redis_close(redis);
+    out.buf = buf;
+    out.next = NULL;
+
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = buf->last - buf->pos;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
 
-    // send OK response
-    char* data = ngx_palloc(r->pool, sizeof(*data) * 6);
-    if (data == NULL) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, 
+    return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t ngx_http_limiter_send_response(ngx_http_request_t* r,
+    ngx_uint_t status, ngx_uint_t success, char* data) {
+
+    ngx_int_t rc;
+    ngx_buf_t* buf;
+    ngx_chain_t out;
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    buf = ngx_create_temp_buf(r->pool,
+        sizeof("{\"success\": false, \"data\": \"\"}") - 1 + ngx_strlen(data));
+    if (buf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
             "failed to allocate data response");
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    data = "hello";
-    char base_resp_success[32] = "{\"success\": true, \"data\": \"\%s\"}";
-    char json_resp_success[35];
+    buf->last = ngx_sprintf(buf->pos, "{\"success\": %s, \"data\": \"%s\"}",
+        success ? "true" : "false", data);
+    buf->last_buf = 1; // will no more buffers in the request
+    buf->last_in_chain = 1;
 
-    sprintf(json_resp_success, base_resp_success, data);
-    json_resp_success[34] = 0x0;
+    out.buf = buf;
+    out.next = NULL;
 
-    buf->pos = (u_char*) json_resp_success; // first position in memory of the data
-    buf->last = (u_char*) json_resp_success + sizeof(json_resp_success) - 1; // last position in memory of the data
-    buf->memory = 1; // read only memory
-    buf->last_buf = 1; // will no more buffers in the request
+    // set content type header
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
 
-    r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_length_n = sizeof(json_resp_success) - 1;
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = buf->last - buf->pos;
 
-    ngx_http_send_header(r); // send headers
-    return ngx_http_output_filter(r, &out);
+    rc = ngx_http_send_header(r); // send headers
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
 
+    return ngx_http_output_filter(r, &out);
 }
 
 static char* ngx_http_limiter(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
+    ngx_http_limiter_loc_conf_t* llcf = conf;
+
+    ngx_str_t* value;
+    ngx_str_t s;
+    ngx_int_t burst;
+    ngx_msec_t delay;
+    ngx_uint_t i;
     ngx_http_core_loc_conf_t* clcf;
 
+    if (llcf->enable != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+            burst = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (burst == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid burst value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            llcf->burst = burst;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "delay=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            delay = ngx_parse_time(&s, 0);
+            if (delay == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "invalid delay value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            llcf->delay = delay;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    llcf->enable = 1;
+
+    // proxy_pass and friends replace this handler when they are set
     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_limiter_handler;
+    if (clcf->handler == NULL) {
+        clcf->handler = ngx_http_limiter_content_handler;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char* ngx_http_limiter_status(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
+    ngx_http_core_loc_conf_t* clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_limiter_status_handler;
 
     return NGX_CONF_OK;
 }
@@ -397,8 +697,28 @@ static ngx_int_t ngx_http_limiter_preconf(ngx_conf_t *cf) {
 
 // module postconfig
 static ngx_int_t ngx_http_limiter_postconf(ngx_conf_t *cf) {
-    ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "postconfig closing...");
-    return 0;
+    ngx_http_handler_pt* h;
+    ngx_http_core_main_conf_t* cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    // limit before access, so delayed requests continue through the phases
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_limiter_handler;
+
+    // adaptive limits learn from finished requests
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_limiter_log_handler;
+
+    return NGX_OK;
 }
 
 // module server create config
@@ -412,9 +732,7 @@ static void* ngx_http_limiter_create_srv_conf(ngx_conf_t* cf) {
         return NGX_CONF_ERROR;
     }
 
-    conf->db = NGX_CONF_UNSET_UINT;
-    conf->max = NGX_CONF_UNSET_UINT;
-    conf->limit_expired = NGX_CONF_UNSET_UINT;
+    ngx_limiter_init_conf(&conf->limiter);
 
     return conf;
 }
@@ -426,28 +744,39 @@ static char* ngx_http_limiter_merge_srv_conf(ngx_conf_t* cf, void* parent, void*
 
     ngx_log_debug0(NGX_LOG_INFO, cf->log, 0, "limiter module: merge server conf");
 
-    ngx_conf_merge_str_value(conf->host, prev->host, NULL);
-    ngx_conf_merge_str_value(conf->port, prev->port, NULL);
-    ngx_conf_merge_str_value(conf->pass, prev->pass, NULL);
-    
-    ngx_conf_merge_uint_value(conf->db, prev->db, 0);
-    ngx_conf_merge_uint_value(conf->max, prev->max, 1);
-    ngx_conf_merge_uint_value(conf->max, prev->limit_expired, 1);
+    ngx_conf_merge_str_value(conf->limiter.prefix, prev->limiter.prefix, "limiter:http:");
 
-    if (conf->max < 1) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "limiter max config must bre greater than 1");
-        return NGX_CONF_ERROR;
-    }
+    return ngx_limiter_merge_conf(cf, &conf->limiter, &prev->limiter);
+}
+
+// module location create config
+static void* ngx_http_limiter_create_loc_conf(ngx_conf_t* cf) {
+    ngx_log_debug0(NGX_LOG_INFO, cf->log, 0, "limiter module: create location conf");
 
-    if (conf->limit_expired < 1) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "limiter expired config must bre greater than 1");
+    ngx_http_limiter_loc_conf_t* conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(*conf));
+    if (conf == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    return NGX_CONF_OK;
+    conf->enable = NGX_CONF_UNSET;
+    conf->burst = NGX_CONF_UNSET_UINT;
+    conf->delay = NGX_CONF_UNSET_MSEC;
+
+    return conf;
 }
 
-static void on_auth_success(void* v) {
-    int d = *((int*) v);
-    printf("on_auth_success %d\n", d);
-}
\ No newline at end of file
+// module location merge config
+static char* ngx_http_limiter_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child) {
+    ngx_http_limiter_loc_conf_t* prev = parent;
+    ngx_http_limiter_loc_conf_t* conf = child;
+
+    ngx_log_debug0(NGX_LOG_INFO, cf->log, 0, "limiter module: merge location conf");
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_uint_value(conf->burst, prev->burst, 0);
+    ngx_conf_merge_msec_value(conf->delay, prev->delay, 0);
+
+    return NGX_CONF_OK;
+}
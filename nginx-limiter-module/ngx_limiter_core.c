@@ -0,0 +1,1242 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2023 Wuriyanto <wuriyanto48@yahoo.co.id>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_sha1.h>
+
+#include "ngx_limiter_core.h"
+
+// lua script run with EVALSHA, the source is sent only when redis lacks it
+typedef struct {
+    ngx_str_t source;
+
+    // hex sha1 of the source, computed on first use
+    u_char sha1[40];
+    ngx_uint_t hashed;
+} ngx_limiter_script_t;
+
+// counts the hits of a batch, hit i is admitted while the window counter KEYS[1]
+// stays within ARGV[1], then held while the counter of the next window KEYS[2]
+// stays within its burst ARGV[i] and ARGV[1]; the next window counter becomes
+// the window counter once the window is over, so held hits count against it
+static ngx_limiter_script_t ngx_limiter_count_script = { ngx_string(
+    "local max = tonumber(ARGV[1])\n"
+    "if redis.call('EXISTS', KEYS[1]) == 0 and redis.call('EXISTS', KEYS[2]) == 1 then\n"
+    "    redis.call('RENAME', KEYS[2], KEYS[1])\n"
+    "end\n"
+    "local v = tonumber(redis.call('GET', KEYS[1]) or 0)\n"
+    "local c = tonumber(redis.call('GET', KEYS[2]) or 0)\n"
+    "local k, h = 0, 0\n"
+    "for i = 3, #ARGV do\n"
+    "    if v + k < max then k = k + 1\n"
+    "    elseif c + h < math.min(tonumber(ARGV[i]), max) then h = h + 1 end\n"
+    "end\n"
+    "if k > 0 then\n"
+    "    redis.call('INCRBY', KEYS[1], k)\n"
+    "end\n"
+    "local t = redis.call('PTTL', KEYS[1])\n"
+    "if t == -1 then\n"
+    "    redis.call('EXPIRE', KEYS[1], ARGV[2])\n"
+    "    t = tonumber(ARGV[2]) * 1000\n"
+    "end\n"
+    "if h > 0 then\n"
+    "    redis.call('INCRBY', KEYS[2], h)\n"
+    "    redis.call('PEXPIRE', KEYS[2], t + tonumber(ARGV[2]) * 1000)\n"
+    "end\n"
+    "return {v, c, t}\n"
+), "", 0 };
+
+// takes up to ARGV[2] tokens of the budget left in the window
+static ngx_limiter_script_t ngx_limiter_lease_script = { ngx_string(
+    "local v = tonumber(redis.call('GET', KEYS[1]) or 0)\n"
+    "local g = math.min(tonumber(ARGV[1]) - v, tonumber(ARGV[2]))\n"
+    "if g > 0 then\n"
+    "    redis.call('INCRBY', KEYS[1], g)\n"
+    "else\n"
+    "    g = 0\n"
+    "end\n"
+    "local t = redis.call('PTTL', KEYS[1])\n"
+    "if t == -1 then\n"
+    "    redis.call('EXPIRE', KEYS[1], ARGV[3])\n"
+    "    t = tonumber(ARGV[3]) * 1000\n"
+    "end\n"
+    "return {g, t}\n"
+), "", 0 };
+
+// state of one key of one limiter config in this worker
+struct ngx_limiter_node_s {
+    ngx_rbtree_node_t node;
+    ngx_queue_t queue;
+
+    ngx_limiter_conf_t* conf;
+
+    // end of the redis window the leased tokens belong to
+    ngx_msec_t expire;
+
+    // leased tokens left to spend locally
+    ngx_uint_t tokens;
+
+    // redis had no more budget for this window
+    ngx_uint_t exhausted;
+
+    // hits over an exhausted lease, held for the next window
+    ngx_uint_t excess;
+
+    // hits held over from the last window, paid from the next lease
+    ngx_uint_t held;
+
+    // hits waiting for the next redis operation
+    ngx_queue_t waiting;
+
+    // hits carried by the redis operation in flight
+    ngx_queue_t inflight;
+    ngx_uint_t busy;
+
+    // bursts of the counted hits, or the tokens asked for a lease
+    ngx_uint_t* bursts;
+    ngx_uint_t nhits;
+    ngx_uint_t chunk;
+
+    // limiter maximum the operation in flight was sent with
+    ngx_uint_t max;
+
+    // key, followed by the suffix of the next window counter
+    u_short len;
+    u_char data[1];
+};
+
+typedef struct ngx_limiter_node_s ngx_limiter_node_t;
+
+static ngx_int_t ngx_limiter_flush(ngx_limiter_node_t* node, ngx_log_t* log);
+static ngx_int_t ngx_limiter_send(ngx_limiter_node_t* node, ngx_uint_t eval, ngx_log_t* log);
+static void ngx_limiter_done(ngx_limiter_redis_cmd_t* cmd);
+static void ngx_limiter_done_count(ngx_limiter_node_t* node, ngx_int_t count,
+    ngx_int_t held, ngx_int_t pttl, ngx_queue_t* done);
+static void ngx_limiter_done_lease(ngx_limiter_node_t* node, ngx_uint_t granted,
+    ngx_int_t pttl, ngx_queue_t* done);
+static void ngx_limiter_idle(ngx_limiter_node_t* node);
+static void ngx_limiter_dispatch(ngx_queue_t* done);
+static ngx_int_t ngx_limiter_lease_spend(ngx_limiter_node_t* node,
+    ngx_limiter_waiter_t* w, ngx_msec_t now);
+static ngx_limiter_node_t* ngx_limiter_node_find(ngx_limiter_conf_t* conf,
+    ngx_str_t* key, uint32_t hash);
+static void ngx_limiter_node_insert_value(ngx_rbtree_node_t* temp,
+    ngx_rbtree_node_t* node, ngx_rbtree_node_t* sentinel);
+static ngx_int_t ngx_limiter_node_cmp(ngx_limiter_node_t* node,
+    ngx_limiter_conf_t* conf, ngx_str_t* key);
+static void ngx_limiter_node_expire(ngx_msec_t now);
+static void ngx_limiter_node_free(ngx_limiter_node_t* node);
+static ngx_int_t ngx_limiter_adaptive_init_zone(ngx_shm_zone_t* shm_zone, void* data);
+
+// per worker keys, most recently used first in the queue
+static ngx_uint_t ngx_limiter_nodes_inited;
+static ngx_rbtree_t ngx_limiter_nodes;
+static ngx_rbtree_node_t ngx_limiter_nodes_sentinel;
+static ngx_queue_t ngx_limiter_nodes_queue;
+
+// longest limiter_key_prefix
+#define NGX_LIMITER_PREFIX_LEN 128
+
+// counter of the hits held for the next window, next to the window counter
+#define NGX_LIMITER_NEXT_SUFFIX ":next"
+
+// tag of the adaptive zones
+static ngx_uint_t ngx_limiter_adaptive_tag;
+
+void ngx_limiter_init_conf(ngx_limiter_conf_t* conf) {
+    conf->db = NGX_CONF_UNSET_UINT;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->max = NGX_CONF_UNSET_UINT;
+    conf->limit_expired = NGX_CONF_UNSET_UINT;
+    conf->lease = NGX_CONF_UNSET_UINT;
+    conf->adaptive = NGX_CONF_UNSET_PTR;
+}
+
+char* ngx_limiter_merge_conf(ngx_conf_t* cf, ngx_limiter_conf_t* conf, ngx_limiter_conf_t* prev) {
+    ngx_url_t u;
+    ngx_limiter_adaptive_t* ctx;
+
+    ngx_conf_merge_str_value(conf->host, prev->host, "127.0.0.1");
+    ngx_conf_merge_str_value(conf->port, prev->port, "6379");
+    ngx_conf_merge_str_value(conf->pass, prev->pass, "");
+
+    ngx_conf_merge_uint_value(conf->db, prev->db, 0);
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 1000);
+
+    ngx_conf_merge_ptr_value(conf->adaptive, prev->adaptive, NULL);
+
+    if (conf->adaptive != NULL && conf->adaptive->data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "unknown limiter_adaptive_zone \"%V\"", &conf->adaptive->shm.name);
+        return NGX_CONF_ERROR;
+    }
+
+    // the adaptive limit caps limiter maximum, which defaults to the zone maximum
+    if (conf->max == NGX_CONF_UNSET_UINT && prev->max == NGX_CONF_UNSET_UINT
+        && conf->adaptive != NULL) {
+
+        ctx = conf->adaptive->data;
+        conf->max = ctx->max;
+    }
+
+    ngx_conf_merge_uint_value(conf->max, prev->max, 1);
+    ngx_conf_merge_uint_value(conf->limit_expired, prev->limit_expired, 1);
+
+    if (conf->lease == NGX_CONF_UNSET_UINT) {
+        conf->lease = (prev->lease == NGX_CONF_UNSET_UINT) ? 0 : prev->lease;
+        conf->lease_percent = prev->lease_percent;
+    }
+
+    if (conf->max < 1) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "limiter max config must bre greater than 1");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->limit_expired < 1) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "limiter expired config must bre greater than 1");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->prefix.len > NGX_LIMITER_PREFIX_LEN) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "limiter key prefix \"%V\" is longer than %d", &conf->prefix, NGX_LIMITER_PREFIX_LEN);
+        return NGX_CONF_ERROR;
+    }
+
+    // workers connect without resolving
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url.len = conf->host.len + 1 + conf->port.len;
+    u.url.data = ngx_pnalloc(cf->pool, u.url.len);
+    if (u.url.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_sprintf(u.url.data, "%V:%V", &conf->host, &conf->port);
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                "%s in limiter redis \"%V\"", u.err, &u.url);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    conf->addr = &u.addrs[0];
+
+    return NGX_CONF_OK;
+}
+
+// limiter_lease <number> | <percent>% | off
+char* ngx_limiter_conf_set_lease(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
+    ngx_limiter_conf_t* lcf = (ngx_limiter_conf_t*) ((char*) conf + cmd->offset);
+
+    size_t len;
+    ngx_int_t n;
+    ngx_str_t* value;
+
+    if (lcf->lease != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lcf->lease = 0;
+        return NGX_CONF_OK;
+    }
+
+    len = value[1].len;
+
+    if (len > 1 && value[1].data[len - 1] == '%') {
+        lcf->lease_percent = 1;
+        len--;
+    }
+
+    n = ngx_atoi(value[1].data, len);
+    if (n == NGX_ERROR || n == 0 || (lcf->lease_percent && n > 100)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid lease \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->lease = n;
+
+    return NGX_CONF_OK;
+}
+
+// limiter_adaptive_zone zone=<name> max=N [min=N] [latency=time] [errors=N%] [interval=time]
+char* ngx_limiter_conf_set_adaptive_zone(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
+    size_t len;
+    ngx_int_t n;
+    ngx_str_t *value, name, s;
+    ngx_uint_t i;
+    ngx_msec_t msec;
+    ngx_shm_zone_t* shm_zone;
+    ngx_limiter_adaptive_t* ctx;
+
+    value = cf->args->elts;
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_limiter_adaptive_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->min = 1;
+    ctx->max = NGX_CONF_UNSET_UINT;
+    ctx->errors = 5;
+    ctx->interval = 1000;
+
+    ngx_str_null(&name);
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+            name.len = value[i].len - 5;
+            name.data = value[i].data + 5;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0
+            || ngx_strncmp(value[i].data, "max=", 4) == 0) {
+
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (value[i].data[1] == 'i') {
+                ctx->min = n;
+            } else {
+                ctx->max = n;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "errors=", 7) == 0) {
+            len = value[i].len - 7;
+
+            if (len > 1 && value[i].data[value[i].len - 1] == '%') {
+                len--;
+            }
+
+            n = ngx_atoi(value[i].data + 7, len);
+            if (n == NGX_ERROR || n > 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->errors = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "latency=", 8) == 0
+            || ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            len = (value[i].data[0] == 'l') ? 8 : 9;
+
+            s.len = value[i].len - len;
+            s.data = value[i].data + len;
+
+            msec = ngx_parse_time(&s, 0);
+            if (msec == (ngx_msec_t) NGX_ERROR || msec == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (len == 8) {
+                ctx->latency = msec;
+            } else {
+                ctx->interval = msec;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"%V\" must have \"zone\" parameter", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    // servers sharing the zone may have different limiter maximums
+    if (ctx->max == NGX_CONF_UNSET_UINT) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "\"%V\" must have \"max\" parameter", &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ctx->min > ctx->max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "min is greater than max");
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &ngx_limiter_adaptive_tag);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_limiter_adaptive_init_zone;
+    shm_zone->data = ctx;
+
+    return NGX_CONF_OK;
+}
+
+// limiter_adaptive zone=<name> | off
+char* ngx_limiter_conf_set_adaptive(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
+    ngx_limiter_conf_t* lcf = (ngx_limiter_conf_t*) ((char*) conf + cmd->offset);
+
+    ngx_str_t *value, name;
+    ngx_shm_zone_t* shm_zone;
+
+    if (lcf->adaptive != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lcf->adaptive = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0 || value[1].len == 5) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = value[1].len - 5;
+    name.data = value[1].data + 5;
+
+    // the zone may be defined further down, merge checks it exists
+    shm_zone = ngx_shared_memory_add(cf, &name, 0, &ngx_limiter_adaptive_tag);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->adaptive = shm_zone;
+
+    return NGX_CONF_OK;
+}
+
+ngx_uint_t ngx_limiter_max(ngx_limiter_conf_t* conf) {
+    ngx_limiter_adaptive_t* ctx;
+
+    if (conf->adaptive == NULL) {
+        return conf->max;
+    }
+
+    ctx = conf->adaptive->data;
+
+    return ngx_min(conf->max, ctx->sh->limit);
+}
+
+void ngx_limiter_adaptive_sample(ngx_limiter_conf_t* conf, ngx_msec_t latency,
+    ngx_uint_t error, ngx_log_t* log) {
+
+    ngx_msec_t now, average;
+    ngx_uint_t limit, prev, requests, errors, overloaded;
+    ngx_limiter_adaptive_t* ctx;
+    ngx_limiter_adaptive_sh_t* sh;
+
+    ctx = conf->adaptive->data;
+    sh = ctx->sh;
+
+    now = ngx_current_msec;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    sh->requests++;
+
+    if (error) {
+        sh->errors++;
+    }
+
+    if (latency != NGX_CONF_UNSET_MSEC) {
+        sh->timed++;
+        sh->latency += latency;
+    }
+
+    if ((ngx_msec_int_t) (now - sh->start) < (ngx_msec_int_t) ctx->interval) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        return;
+    }
+
+    requests = sh->requests;
+    errors = sh->errors;
+    average = sh->timed ? sh->latency / sh->timed : 0;
+
+    overloaded = (errors * 100 > requests * ctx->errors)
+        || (ctx->latency && average > ctx->latency);
+
+    // additive increase, multiplicative decrease
+    prev = sh->limit;
+
+    if (overloaded) {
+        limit = ngx_max(prev / 2, ctx->min);
+    } else {
+        limit = (prev < ctx->max) ? prev + 1 : ctx->max;
+    }
+
+    sh->limit = limit;
+
+    sh->last_requests = requests;
+    sh->last_errors = errors;
+    sh->last_latency = average;
+
+    sh->start = now;
+    sh->requests = 0;
+    sh->errors = 0;
+    sh->timed = 0;
+    sh->latency = 0;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (limit < prev) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+            "limiter: zone \"%V\" limit lowered from %ui to %ui, errors: %ui/%ui, latency: %Mms",
+            &conf->adaptive->shm.name, prev, limit, errors, requests, average);
+    }
+}
+
+ngx_limiter_adaptive_t* ngx_limiter_adaptive_zone(ngx_shm_zone_t* shm_zone) {
+    if (shm_zone->tag != &ngx_limiter_adaptive_tag) {
+        return NULL;
+    }
+
+    return shm_zone->data;
+}
+
+static ngx_int_t ngx_limiter_adaptive_init_zone(ngx_shm_zone_t* shm_zone, void* data) {
+    ngx_limiter_adaptive_t* octx = data;
+
+    ngx_limiter_adaptive_t* ctx;
+
+    ctx = shm_zone->data;
+
+    // a reload keeps the limit learned so far, within the new bounds
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        if (ctx->sh->limit < ctx->min) {
+            ctx->sh->limit = ctx->min;
+        }
+
+        if (ctx->sh->limit > ctx->max) {
+            ctx->sh->limit = ctx->max;
+        }
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t*) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_calloc(ctx->shpool, sizeof(ngx_limiter_adaptive_sh_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    // start from the upper bound and back off on the first bad interval
+    ctx->sh->limit = ctx->max;
+    ctx->sh->start = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+ngx_int_t ngx_limiter_lookup(ngx_limiter_conf_t* conf, ngx_str_t* addr,
+    ngx_limiter_waiter_t* w, ngx_log_t* log) {
+
+    uint32_t hash;
+    ngx_int_t rc;
+    ngx_msec_t now;
+    ngx_str_t *key, prefixed;
+    ngx_limiter_node_t* node;
+    u_char data[NGX_LIMITER_PREFIX_LEN + NGX_SOCKADDR_STRLEN];
+
+    w->rc = NGX_ERROR;
+    w->excess = 0;
+    w->wait = 0;
+    w->linked = 0;
+
+    if (addr->len > NGX_SOCKADDR_STRLEN) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "limiter key \"%V\" is too long", addr);
+        return NGX_ERROR;
+    }
+
+    prefixed.data = data;
+    prefixed.len = ngx_cpymem(ngx_cpymem(data, conf->prefix.data, conf->prefix.len),
+        addr->data, addr->len) - data;
+
+    key = &prefixed;
+
+    if (!ngx_limiter_nodes_inited) {
+        ngx_rbtree_init(&ngx_limiter_nodes, &ngx_limiter_nodes_sentinel,
+            ngx_limiter_node_insert_value);
+        ngx_queue_init(&ngx_limiter_nodes_queue);
+        ngx_limiter_nodes_inited = 1;
+    }
+
+    now = ngx_current_msec;
+
+    ngx_limiter_node_expire(now);
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    node = ngx_limiter_node_find(conf, key, hash);
+
+    if (node == NULL) {
+        node = ngx_alloc(offsetof(ngx_limiter_node_t, data) + key->len
+            + sizeof(NGX_LIMITER_NEXT_SUFFIX) - 1, log);
+        if (node == NULL) {
+            return NGX_ERROR;
+        }
+
+        node->node.key = hash;
+        node->conf = conf;
+        node->expire = now;
+        node->tokens = 0;
+        node->exhausted = 0;
+        node->excess = 0;
+        node->held = 0;
+        node->busy = 0;
+        node->bursts = NULL;
+        node->nhits = 0;
+        node->chunk = 0;
+        node->max = 0;
+        node->len = (u_short) key->len;
+        ngx_memcpy(ngx_cpymem(node->data, key->data, key->len),
+            NGX_LIMITER_NEXT_SUFFIX, sizeof(NGX_LIMITER_NEXT_SUFFIX) - 1);
+
+        ngx_queue_init(&node->waiting);
+        ngx_queue_init(&node->inflight);
+
+        ngx_rbtree_insert(&ngx_limiter_nodes, &node->node);
+
+    } else {
+        ngx_queue_remove(&node->queue);
+    }
+
+    ngx_queue_insert_head(&ngx_limiter_nodes_queue, &node->queue);
+
+    if (conf->lease) {
+        rc = ngx_limiter_lease_spend(node, w, now);
+        if (rc != NGX_AGAIN) {
+            return rc;
+        }
+    }
+
+    // join the next redis operation of the key
+    ngx_queue_insert_tail(&node->waiting, &w->queue);
+    w->linked = 1;
+
+    if (node->busy) {
+        return NGX_AGAIN;
+    }
+
+    if (ngx_limiter_flush(node, log) != NGX_OK) {
+        ngx_queue_remove(&w->queue);
+        w->linked = 0;
+
+        ngx_limiter_idle(node);
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+void ngx_limiter_cancel(ngx_limiter_waiter_t* w) {
+    if (w->linked) {
+        ngx_queue_remove(&w->queue);
+        w->linked = 0;
+    }
+}
+
+// send the waiting hits of the key as one redis operation
+static ngx_int_t ngx_limiter_flush(ngx_limiter_node_t* node, ngx_log_t* log) {
+    ngx_msec_t now;
+    ngx_uint_t n, max, chunk;
+    ngx_uint_t* bursts;
+    ngx_queue_t* q;
+    ngx_limiter_conf_t* conf;
+    ngx_limiter_waiter_t* w;
+
+    conf = node->conf;
+
+    if (conf->redis == NULL) {
+        conf->redis = ngx_limiter_redis_get(conf->addr, &conf->pass, conf->db,
+            conf->timeout, ngx_cycle->log);
+        if (conf->redis == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    n = 0;
+
+    for (q = ngx_queue_head(&node->waiting);
+        q != ngx_queue_sentinel(&node->waiting);
+        q = ngx_queue_next(q)) {
+
+        w = ngx_queue_data(q, ngx_limiter_waiter_t, queue);
+        w->index = n++;
+    }
+
+    bursts = NULL;
+    chunk = 0;
+    max = ngx_limiter_max(conf);
+
+    if (conf->lease) {
+        chunk = conf->lease_percent ? max * conf->lease / 100 : conf->lease;
+        chunk = ngx_max(chunk, n);
+
+        // hits held when the window ran out count against the next one,
+        // if this lease opens it
+        now = ngx_current_msec;
+        node->held = 0;
+
+        if ((ngx_msec_int_t) (node->expire - now) <= 0) {
+            if ((ngx_msec_int_t) (now - node->expire) < (ngx_msec_int_t) (conf->limit_expired * 1000)) {
+                node->held = node->excess;
+            }
+
+            node->excess = 0;
+            chunk += node->held;
+        }
+
+    } else {
+        bursts = ngx_alloc(n * sizeof(ngx_uint_t), log);
+        if (bursts == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (q = ngx_queue_head(&node->waiting);
+            q != ngx_queue_sentinel(&node->waiting);
+            q = ngx_queue_next(q)) {
+
+            w = ngx_queue_data(q, ngx_limiter_waiter_t, queue);
+            bursts[w->index] = w->burst;
+        }
+    }
+
+    node->bursts = bursts;
+    node->nhits = n;
+    node->chunk = chunk;
+    node->max = max;
+
+    if (ngx_limiter_send(node, 0, log) != NGX_OK) {
+        if (bursts != NULL) {
+            ngx_free(bursts);
+            node->bursts = NULL;
+        }
+
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0,
+        "limiter: %ui hits of \"%*s\" in one redis operation", n, (size_t) node->len, node->data);
+
+    node->busy = 1;
+
+    ngx_queue_add(&node->inflight, &node->waiting);
+    ngx_queue_init(&node->waiting);
+
+    return NGX_OK;
+}
+
+// run the script of the node's operation, by its sha1 unless eval is set
+static ngx_int_t ngx_limiter_send(ngx_limiter_node_t* node, ngx_uint_t eval, ngx_log_t* log) {
+    u_char digest[20];
+    ngx_str_t name, body;
+    ngx_uint_t i, nkeys, nargs;
+    ngx_sha1_t sha1;
+    ngx_limiter_conf_t* conf;
+    ngx_limiter_script_t* script;
+    ngx_limiter_redis_cmd_t* cmd;
+
+    conf = node->conf;
+
+    script = conf->lease ? &ngx_limiter_lease_script : &ngx_limiter_count_script;
+
+    if (!script->hashed) {
+        ngx_sha1_init(&sha1);
+        ngx_sha1_update(&sha1, script->source.data, script->source.len);
+        ngx_sha1_final(digest, &sha1);
+
+        ngx_hex_dump(script->sha1, digest, sizeof(digest));
+        script->hashed = 1;
+    }
+
+    if (eval) {
+        ngx_str_set(&name, "EVAL");
+        body = script->source;
+
+    } else {
+        ngx_str_set(&name, "EVALSHA");
+        body.len = sizeof(script->sha1);
+        body.data = script->sha1;
+    }
+
+    // lease: script 1 key max chunk expired
+    // count: script 2 key next max expired burst...
+    nkeys = conf->lease ? 1 : 2;
+    nargs = conf->lease ? 3 : 2 + node->nhits;
+
+    cmd = ngx_limiter_redis_cmd_create(3 + nkeys + nargs,
+        NGX_LIMITER_REDIS_ARG_LEN(name.len)
+        + NGX_LIMITER_REDIS_ARG_LEN(body.len)
+        + NGX_LIMITER_REDIS_ARG_LEN(1)
+        + NGX_LIMITER_REDIS_ARG_LEN(node->len)
+        + NGX_LIMITER_REDIS_ARG_LEN(node->len + sizeof(NGX_LIMITER_NEXT_SUFFIX) - 1)
+        + nargs * NGX_LIMITER_REDIS_ARG_LEN(NGX_INT_T_LEN), log);
+    if (cmd == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_limiter_redis_cmd_arg(cmd, name.data, name.len);
+    ngx_limiter_redis_cmd_arg(cmd, body.data, body.len);
+    ngx_limiter_redis_cmd_num(cmd, nkeys);
+    ngx_limiter_redis_cmd_arg(cmd, node->data, node->len);
+
+    if (!conf->lease) {
+        ngx_limiter_redis_cmd_arg(cmd, node->data, node->len + sizeof(NGX_LIMITER_NEXT_SUFFIX) - 1);
+    }
+
+    ngx_limiter_redis_cmd_num(cmd, node->max);
+
+    if (conf->lease) {
+        ngx_limiter_redis_cmd_num(cmd, node->chunk);
+        ngx_limiter_redis_cmd_num(cmd, conf->limit_expired);
+
+    } else {
+        ngx_limiter_redis_cmd_num(cmd, conf->limit_expired);
+
+        for (i = 0; i < node->nhits; i++) {
+            ngx_limiter_redis_cmd_num(cmd, node->bursts[i]);
+        }
+    }
+
+    cmd->handler = ngx_limiter_done;
+    cmd->data = node;
+
+    if (ngx_limiter_redis_send(conf->redis, cmd) != NGX_OK) {
+        ngx_limiter_redis_cmd_free(cmd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+// fan the result of a redis operation out to the hits it carried
+static void ngx_limiter_done(ngx_limiter_redis_cmd_t* cmd) {
+    ngx_queue_t done, *q;
+    ngx_limiter_node_t* node;
+    ngx_limiter_waiter_t* w;
+
+    node = cmd->data;
+
+    // redis restarted or flushed its script cache, EVAL loads the script again
+    if (cmd->rc == NGX_DECLINED && ngx_limiter_send(node, 1, ngx_cycle->log) == NGX_OK) {
+        return;
+    }
+
+    ngx_queue_init(&done);
+
+    if (cmd->rc == NGX_OK && node->conf->lease && cmd->nvalues == 2) {
+        ngx_limiter_done_lease(node, ngx_max(cmd->values[0], 0), cmd->values[1], &done);
+
+    } else if (cmd->rc == NGX_OK && !node->conf->lease && cmd->nvalues == 3) {
+        ngx_limiter_done_count(node, cmd->values[0], cmd->values[1], cmd->values[2], &done);
+
+    } else {
+        while (!ngx_queue_empty(&node->inflight)) {
+            q = ngx_queue_head(&node->inflight);
+            ngx_queue_remove(q);
+
+            w = ngx_queue_data(q, ngx_limiter_waiter_t, queue);
+            w->rc = NGX_ERROR;
+
+            ngx_queue_insert_tail(&done, q);
+        }
+    }
+
+    if (node->bursts != NULL) {
+        ngx_free(node->bursts);
+        node->bursts = NULL;
+    }
+
+    // still busy, hits of the key looked up from the handlers wait for the next operation
+    ngx_limiter_dispatch(&done);
+
+    ngx_limiter_idle(node);
+}
+
+static void ngx_limiter_done_count(ngx_limiter_node_t* node, ngx_int_t count,
+    ngx_int_t held, ngx_int_t pttl, ngx_queue_t* done) {
+
+    ngx_int_t max;
+    ngx_msec_t wait;
+    ngx_uint_t i, admitted;
+    ngx_queue_t* q;
+    ngx_limiter_waiter_t* w;
+
+    max = (ngx_int_t) node->max;
+    admitted = 0;
+
+    wait = (pttl > 0) ? (ngx_msec_t) pttl : node->conf->limit_expired * 1000;
+
+    // same decisions as the script, cancelled hits were counted too
+    for (i = 0; i < node->nhits; i++) {
+
+        w = NULL;
+
+        if (!ngx_queue_empty(&node->inflight)) {
+            q = ngx_queue_head(&node->inflight);
+            w = ngx_queue_data(q, ngx_limiter_waiter_t, queue);
+
+            if (w->index != i) {
+                w = NULL;
+            }
+        }
+
+        if (count < max) {
+            count++;
+            admitted++;
+
+            if (w != NULL) {
+                w->rc = NGX_OK;
+            }
+
+        } else if (held < ngx_min((ngx_int_t) node->bursts[i], max)) {
+            held++;
+            admitted++;
+
+            if (w != NULL) {
+                w->rc = NGX_OK;
+                w->excess = held;
+                w->wait = wait;
+            }
+
+        } else if (w != NULL) {
+            w->rc = NGX_BUSY;
+        }
+
+        if (w != NULL) {
+            ngx_queue_remove(&w->queue);
+            ngx_queue_insert_tail(done, &w->queue);
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+        "limiter: %ui of %ui hits admitted", admitted, node->nhits);
+}
+
+static void ngx_limiter_done_lease(ngx_limiter_node_t* node, ngx_uint_t granted,
+    ngx_int_t pttl, ngx_queue_t* done) {
+
+    ngx_int_t rc;
+    ngx_msec_t now;
+    ngx_uint_t paid;
+    ngx_queue_t pending, *q;
+    ngx_limiter_waiter_t* w;
+
+    now = ngx_current_msec;
+
+    // the hits held over already ran, budget short of them is not made up
+    paid = ngx_min(granted, node->held);
+    node->held = 0;
+
+    node->expire = now + ((pttl > 0) ? (ngx_msec_t) pttl : node->conf->limit_expired * 1000);
+    node->tokens = granted - paid;
+    node->exhausted = (granted < node->chunk);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+        "limiter: leased %ui of %ui tokens for \"%*s\"",
+        granted, node->chunk, (size_t) node->len, node->data);
+
+    // the hits that arrived meanwhile can be served from the same lease
+    ngx_queue_init(&pending);
+
+    if (!ngx_queue_empty(&node->inflight)) {
+        ngx_queue_add(&pending, &node->inflight);
+        ngx_queue_init(&node->inflight);
+    }
+
+    if (!ngx_queue_empty(&node->waiting)) {
+        ngx_queue_add(&pending, &node->waiting);
+        ngx_queue_init(&node->waiting);
+    }
+
+    while (!ngx_queue_empty(&pending)) {
+        q = ngx_queue_head(&pending);
+        ngx_queue_remove(q);
+
+        w = ngx_queue_data(q, ngx_limiter_waiter_t, queue);
+
+        rc = ngx_limiter_lease_spend(node, w, now);
+
+        if (rc == NGX_AGAIN) {
+            ngx_queue_insert_tail(&node->waiting, q);
+            continue;
+        }
+
+        w->rc = rc;
+        ngx_queue_insert_tail(done, q);
+    }
+}
+
+// the operation of the key is over, start the next one or forget the key
+static void ngx_limiter_idle(ngx_limiter_node_t* node) {
+    ngx_queue_t failed, *q;
+    ngx_limiter_waiter_t* w;
+
+    for ( ;; ) {
+        node->busy = 0;
+
+        if (ngx_queue_empty(&node->waiting)) {
+            break;
+        }
+
+        if (ngx_limiter_flush(node, ngx_cycle->log) == NGX_OK) {
+            return;
+        }
+
+        node->busy = 1;
+
+        ngx_queue_init(&failed);
+        ngx_queue_add(&failed, &node->waiting);
+        ngx_queue_init(&node->waiting);
+
+        for (q = ngx_queue_head(&failed);
+            q != ngx_queue_sentinel(&failed);
+            q = ngx_queue_next(q)) {
+
+            w = ngx_queue_data(q, ngx_limiter_waiter_t, queue);
+            w->rc = NGX_ERROR;
+        }
+
+        ngx_limiter_dispatch(&failed);
+    }
+
+    // only leases outlive their redis operation
+    if (!node->conf->lease) {
+        ngx_limiter_node_free(node);
+    }
+}
+
+static void ngx_limiter_dispatch(ngx_queue_t* done) {
+    ngx_queue_t* q;
+    ngx_limiter_waiter_t* w;
+
+    // handlers may cancel the waiters still in the queue
+    while (!ngx_queue_empty(done)) {
+        q = ngx_queue_head(done);
+        ngx_queue_remove(q);
+
+        w = ngx_queue_data(q, ngx_limiter_waiter_t, queue);
+        w->linked = 0;
+
+        w->handler(w);
+    }
+}
+
+// spend a leased token, NGX_AGAIN when a new lease is needed
+static ngx_int_t ngx_limiter_lease_spend(ngx_limiter_node_t* node,
+    ngx_limiter_waiter_t* w, ngx_msec_t now) {
+
+    if ((ngx_msec_int_t) (node->expire - now) <= 0) {
+        return NGX_AGAIN;
+    }
+
+    if (node->tokens > 0) {
+        node->tokens--;
+        return NGX_OK;
+    }
+
+    // no budget left in redis until the window expires
+    if (!node->exhausted) {
+        return NGX_AGAIN;
+    }
+
+    // held until the window is over and paid from the lease of the next one
+    if (node->excess >= ngx_min(w->burst, ngx_limiter_max(node->conf))) {
+        return NGX_BUSY;
+    }
+
+    node->excess++;
+
+    w->excess = node->excess;
+    w->wait = node->expire - now;
+
+    return NGX_OK;
+}
+
+// drop idle leases whose window is over, the tokens expired with the redis key;
+// leases holding hits are kept through the next window that pays for them
+static void ngx_limiter_node_expire(ngx_msec_t now) {
+    ngx_uint_t n;
+    ngx_msec_t expire;
+    ngx_queue_t* q;
+    ngx_limiter_node_t* node;
+
+    for (n = 0; n < 2; n++) {
+        if (ngx_queue_empty(&ngx_limiter_nodes_queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&ngx_limiter_nodes_queue);
+        node = ngx_queue_data(q, ngx_limiter_node_t, queue);
+
+        expire = node->expire;
+
+        if (node->excess) {
+            expire += node->conf->limit_expired * 1000;
+        }
+
+        if (node->busy || (ngx_msec_int_t) (expire - now) > 0) {
+            return;
+        }
+
+        ngx_limiter_node_free(node);
+    }
+}
+
+static void ngx_limiter_node_free(ngx_limiter_node_t* node) {
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&ngx_limiter_nodes, &node->node);
+    ngx_free(node);
+}
+
+static ngx_limiter_node_t* ngx_limiter_node_find(ngx_limiter_conf_t* conf,
+    ngx_str_t* key, uint32_t hash) {
+
+    ngx_int_t rc;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_limiter_node_t* ln;
+
+    node = ngx_limiter_nodes.root;
+    sentinel = ngx_limiter_nodes.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        ln = (ngx_limiter_node_t*) node;
+
+        rc = ngx_limiter_node_cmp(ln, conf, key);
+        if (rc == 0) {
+            return ln;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static void ngx_limiter_node_insert_value(ngx_rbtree_node_t* temp,
+    ngx_rbtree_node_t* node, ngx_rbtree_node_t* sentinel) {
+
+    ngx_str_t key;
+    ngx_rbtree_node_t** p;
+    ngx_limiter_node_t* ln;
+
+    ln = (ngx_limiter_node_t*) node;
+    key.len = ln->len;
+    key.data = ln->data;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else {
+            p = (ngx_limiter_node_cmp((ngx_limiter_node_t*) temp, ln->conf, &key) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+// order of a key and config relative to the node, same hash assumed
+static ngx_int_t ngx_limiter_node_cmp(ngx_limiter_node_t* node,
+    ngx_limiter_conf_t* conf, ngx_str_t* key) {
+
+    ngx_int_t rc;
+
+    rc = ngx_memn2cmp(key->data, node->data, key->len, node->len);
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (conf == node->conf) {
+        return 0;
+    }
+
+    return ((uintptr_t) conf < (uintptr_t) node->conf) ? -1 : 1;
+}
@@ -0,0 +1,155 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2023 Wuriyanto <wuriyanto48@yahoo.co.id>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef NGX_LIMITER_CORE_H
+#define NGX_LIMITER_CORE_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_limiter_redis.h"
+
+// adaptive limit of a zone, shared by the workers
+typedef struct {
+    // effective limiter maximum
+    ngx_uint_t limit;
+
+    // samples of the current interval
+    ngx_msec_t start;
+    ngx_uint_t requests;
+    ngx_uint_t errors;
+    ngx_uint_t timed;
+    ngx_msec_t latency;
+
+    // samples of the last complete interval, for stats
+    ngx_uint_t last_requests;
+    ngx_uint_t last_errors;
+    ngx_msec_t last_latency;
+} ngx_limiter_adaptive_sh_t;
+
+typedef struct {
+    ngx_limiter_adaptive_sh_t* sh;
+    ngx_slab_pool_t* shpool;
+
+    // bounds of the effective limit
+    ngx_uint_t min;
+    ngx_uint_t max;
+
+    // average upstream response time and 5xx percentage that halve the limit
+    ngx_msec_t latency;
+    ngx_uint_t errors;
+
+    // how often the limit is adjusted
+    ngx_msec_t interval;
+} ngx_limiter_adaptive_t;
+
+// limiter settings shared by the http and stream modules
+struct ngx_limiter_conf_s {
+    // redis config
+    ngx_str_t host;
+    ngx_str_t port;
+    ngx_str_t pass;
+
+    // prepended to the client address in redis keys, the http and stream
+    // modules default to their own so their counters stay apart
+    ngx_str_t prefix;
+    ngx_uint_t db;
+    ngx_msec_t timeout;
+
+    // limiter maximum
+    ngx_uint_t max;
+
+    // limit expired in seconds
+    ngx_uint_t limit_expired;
+
+    // tokens a worker leases from redis at once, 0 counts every hit in redis
+    ngx_uint_t lease;
+
+    // lease is a percentage of limiter maximum
+    ngx_flag_t lease_percent;
+
+    // zone adapting limiter maximum to upstream feedback, NULL keeps it static
+    ngx_shm_zone_t* adaptive;
+
+    // redis address, resolved when the configuration is read
+    ngx_addr_t* addr;
+
+    // connection of the current worker
+    ngx_limiter_redis_t* redis;
+};
+
+typedef struct ngx_limiter_conf_s ngx_limiter_conf_t;
+typedef struct ngx_limiter_waiter_s ngx_limiter_waiter_t;
+
+typedef void (*ngx_limiter_handler_pt) (ngx_limiter_waiter_t* w);
+
+// one hit waiting for redis, owned by the request or session
+struct ngx_limiter_waiter_s {
+    ngx_queue_t queue;
+
+    // hits held for the next window once limiter maximum is reached
+    ngx_uint_t burst;
+
+    // NGX_OK, NGX_BUSY over the burst, NGX_ERROR when redis is unavailable;
+    // a held hit has its position among the hits held for the next window in
+    // excess, counted against that window, and the time left until it in wait
+    ngx_int_t rc;
+    ngx_uint_t excess;
+    ngx_msec_t wait;
+
+    // called with the result when the lookup returned NGX_AGAIN
+    ngx_limiter_handler_pt handler;
+    void* data;
+
+    // position in the redis operation carrying the hit
+    ngx_uint_t index;
+    ngx_uint_t linked;
+};
+
+void ngx_limiter_init_conf(ngx_limiter_conf_t* conf);
+char* ngx_limiter_merge_conf(ngx_conf_t* cf, ngx_limiter_conf_t* conf, ngx_limiter_conf_t* prev);
+char* ngx_limiter_conf_set_lease(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+char* ngx_limiter_conf_set_adaptive_zone(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+char* ngx_limiter_conf_set_adaptive(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+
+// count a hit of client addr against its window, concurrent hits of a key share one
+// redis operation; returns the result like w->rc, or NGX_AGAIN and calls w->handler later
+ngx_int_t ngx_limiter_lookup(ngx_limiter_conf_t* conf, ngx_str_t* addr,
+    ngx_limiter_waiter_t* w, ngx_log_t* log);
+
+// forget a waiter whose request is gone before its result
+void ngx_limiter_cancel(ngx_limiter_waiter_t* w);
+
+// limiter maximum in effect, the configured one capped by the adaptive limit
+ngx_uint_t ngx_limiter_max(ngx_limiter_conf_t* conf);
+
+// feed one finished request to the adaptive zone, latency is NGX_CONF_UNSET_MSEC
+// when there was no upstream response
+void ngx_limiter_adaptive_sample(ngx_limiter_conf_t* conf, ngx_msec_t latency,
+    ngx_uint_t error, ngx_log_t* log);
+
+// adaptive state of a shared memory zone, NULL for zones of other modules
+ngx_limiter_adaptive_t* ngx_limiter_adaptive_zone(ngx_shm_zone_t* shm_zone);
+
+#endif
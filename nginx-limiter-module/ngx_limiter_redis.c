@@ -0,0 +1,616 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2023 Wuriyanto <wuriyanto48@yahoo.co.id>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+#include "ngx_limiter_redis.h"
+
+static ngx_int_t ngx_limiter_redis_connect(ngx_limiter_redis_t* redis);
+static void ngx_limiter_redis_close(ngx_limiter_redis_t* redis);
+static void ngx_limiter_redis_write_handler(ngx_event_t* wev);
+static void ngx_limiter_redis_read_handler(ngx_event_t* rev);
+static ngx_int_t ngx_limiter_redis_process(ngx_limiter_redis_t* redis);
+static ngx_int_t ngx_limiter_redis_parse(ngx_limiter_redis_cmd_t* cmd,
+    u_char** pos, u_char* last, ngx_uint_t depth);
+static ngx_int_t ngx_limiter_redis_atoi(u_char* p, u_char* last, ngx_int_t* value);
+static void ngx_limiter_redis_auth_handler(ngx_limiter_redis_cmd_t* cmd);
+
+// connections of this worker, one per backend
+static ngx_uint_t ngx_limiter_redis_inited;
+static ngx_queue_t ngx_limiter_redis_backends;
+
+ngx_limiter_redis_t* ngx_limiter_redis_get(ngx_addr_t* addr, ngx_str_t* pass,
+    ngx_uint_t db, ngx_msec_t timeout, ngx_log_t* log) {
+
+    ngx_queue_t* q;
+    ngx_limiter_redis_t* redis;
+
+    if (!ngx_limiter_redis_inited) {
+        ngx_queue_init(&ngx_limiter_redis_backends);
+        ngx_limiter_redis_inited = 1;
+    }
+
+    for (q = ngx_queue_head(&ngx_limiter_redis_backends);
+        q != ngx_queue_sentinel(&ngx_limiter_redis_backends);
+        q = ngx_queue_next(q)) {
+
+        redis = ngx_queue_data(q, ngx_limiter_redis_t, queue);
+
+        if (redis->addr->socklen == addr->socklen
+            && ngx_memcmp(redis->addr->sockaddr, addr->sockaddr, addr->socklen) == 0
+            && redis->db == db
+            && redis->timeout == timeout
+            && redis->pass.len == pass->len
+            && ngx_strncmp(redis->pass.data, pass->data, pass->len) == 0) {
+            return redis;
+        }
+    }
+
+    redis = ngx_calloc(sizeof(ngx_limiter_redis_t) + NGX_LIMITER_REDIS_BUFFER_SIZE, log);
+    if (redis == NULL) {
+        return NULL;
+    }
+
+    redis->addr = addr;
+    redis->pass = *pass;
+    redis->db = db;
+    redis->timeout = timeout;
+
+    ngx_queue_init(&redis->sending);
+    ngx_queue_init(&redis->waiting);
+
+    redis->start = (u_char*) (redis + 1);
+    redis->pos = redis->start;
+    redis->last = redis->start;
+    redis->end = redis->start + NGX_LIMITER_REDIS_BUFFER_SIZE;
+
+    ngx_queue_insert_tail(&ngx_limiter_redis_backends, &redis->queue);
+
+    return redis;
+}
+
+ngx_limiter_redis_cmd_t* ngx_limiter_redis_cmd_create(ngx_uint_t nargs, size_t size, ngx_log_t* log) {
+    ngx_limiter_redis_cmd_t* cmd;
+
+    size += sizeof("*\r\n") - 1 + NGX_INT_T_LEN;
+
+    cmd = ngx_alloc(sizeof(ngx_limiter_redis_cmd_t) + size, log);
+    if (cmd == NULL) {
+        return NULL;
+    }
+
+    cmd->handler = NULL;
+    cmd->data = NULL;
+    cmd->rc = NGX_ERROR;
+    cmd->nvalues = 0;
+
+    ngx_memzero(&cmd->buf, sizeof(ngx_buf_t));
+
+    cmd->buf.temporary = 1;
+    cmd->buf.start = (u_char*) (cmd + 1);
+    cmd->buf.end = cmd->buf.start + size;
+    cmd->buf.pos = cmd->buf.start;
+    cmd->buf.last = ngx_sprintf(cmd->buf.start, "*%ui\r\n", nargs);
+
+    cmd->out.buf = &cmd->buf;
+    cmd->out.next = NULL;
+
+    return cmd;
+}
+
+void ngx_limiter_redis_cmd_arg(ngx_limiter_redis_cmd_t* cmd, u_char* data, size_t len) {
+    cmd->buf.last = ngx_sprintf(cmd->buf.last, "$%uz\r\n", len);
+    cmd->buf.last = ngx_cpymem(cmd->buf.last, data, len);
+    *cmd->buf.last++ = CR;
+    *cmd->buf.last++ = LF;
+}
+
+void ngx_limiter_redis_cmd_num(ngx_limiter_redis_cmd_t* cmd, ngx_uint_t n) {
+    u_char buf[NGX_INT_T_LEN];
+
+    ngx_limiter_redis_cmd_arg(cmd, buf, ngx_sprintf(buf, "%ui", n) - buf);
+}
+
+void ngx_limiter_redis_cmd_free(ngx_limiter_redis_cmd_t* cmd) {
+    ngx_free(cmd);
+}
+
+ngx_int_t ngx_limiter_redis_send(ngx_limiter_redis_t* redis, ngx_limiter_redis_cmd_t* cmd) {
+    if (redis->connection == NULL && ngx_limiter_redis_connect(redis) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_insert_tail(&redis->sending, &cmd->queue);
+
+    // written once the event loop iteration is over, together with the commands
+    // of every other request, and a failed write never calls back into the sender
+    if (!redis->connecting && !redis->connection->write->posted) {
+        ngx_post_event(redis->connection->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_limiter_redis_connect(ngx_limiter_redis_t* redis) {
+    ngx_int_t rc;
+    ngx_connection_t* c;
+    ngx_limiter_redis_cmd_t* cmd;
+
+    ngx_memzero(&redis->peer, sizeof(ngx_peer_connection_t));
+
+    redis->peer.sockaddr = redis->addr->sockaddr;
+    redis->peer.socklen = redis->addr->socklen;
+    redis->peer.name = &redis->addr->name;
+    redis->peer.get = ngx_event_get_peer;
+    redis->peer.log = ngx_cycle->log;
+    redis->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&redis->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+            "limiter: redis connect to %V failed", &redis->addr->name);
+        return NGX_ERROR;
+    }
+
+    c = redis->peer.connection;
+    c->data = redis;
+    c->read->handler = ngx_limiter_redis_read_handler;
+    c->write->handler = ngx_limiter_redis_write_handler;
+
+    redis->connection = c;
+    redis->pos = redis->start;
+    redis->last = redis->start;
+
+    // a new connection authenticates and selects the database before anything else
+    if (redis->pass.len > 0) {
+        cmd = ngx_limiter_redis_cmd_create(2,
+            NGX_LIMITER_REDIS_ARG_LEN(sizeof("AUTH") - 1)
+            + NGX_LIMITER_REDIS_ARG_LEN(redis->pass.len), ngx_cycle->log);
+        if (cmd == NULL) {
+            ngx_limiter_redis_close(redis);
+            return NGX_ERROR;
+        }
+
+        ngx_limiter_redis_cmd_arg(cmd, (u_char*) "AUTH", sizeof("AUTH") - 1);
+        ngx_limiter_redis_cmd_arg(cmd, redis->pass.data, redis->pass.len);
+        cmd->handler = ngx_limiter_redis_auth_handler;
+
+        ngx_queue_insert_tail(&redis->sending, &cmd->queue);
+    }
+
+    if (redis->db > 0) {
+        cmd = ngx_limiter_redis_cmd_create(2,
+            NGX_LIMITER_REDIS_ARG_LEN(sizeof("SELECT") - 1)
+            + NGX_LIMITER_REDIS_ARG_LEN(NGX_INT_T_LEN), ngx_cycle->log);
+        if (cmd == NULL) {
+            ngx_limiter_redis_close(redis);
+            return NGX_ERROR;
+        }
+
+        ngx_limiter_redis_cmd_arg(cmd, (u_char*) "SELECT", sizeof("SELECT") - 1);
+        ngx_limiter_redis_cmd_num(cmd, redis->db);
+        cmd->handler = ngx_limiter_redis_auth_handler;
+
+        ngx_queue_insert_tail(&redis->sending, &cmd->queue);
+    }
+
+    if (rc == NGX_AGAIN) {
+        redis->connecting = 1;
+        ngx_add_timer(c->write, redis->timeout);
+    }
+
+    return NGX_OK;
+}
+
+// fail every queued command and drop the connection, the next command reconnects
+static void ngx_limiter_redis_close(ngx_limiter_redis_t* redis) {
+    ngx_queue_t failed, *q;
+    ngx_limiter_redis_cmd_t* cmd;
+
+    if (redis->connection != NULL) {
+        ngx_close_connection(redis->connection);
+        redis->connection = NULL;
+    }
+
+    redis->connecting = 0;
+
+    ngx_queue_init(&failed);
+
+    if (!ngx_queue_empty(&redis->waiting)) {
+        ngx_queue_add(&failed, &redis->waiting);
+        ngx_queue_init(&redis->waiting);
+    }
+
+    if (!ngx_queue_empty(&redis->sending)) {
+        ngx_queue_add(&failed, &redis->sending);
+        ngx_queue_init(&redis->sending);
+    }
+
+    // handlers may send new commands on a new connection
+    while (!ngx_queue_empty(&failed)) {
+        q = ngx_queue_head(&failed);
+        ngx_queue_remove(q);
+
+        cmd = ngx_queue_data(q, ngx_limiter_redis_cmd_t, queue);
+        cmd->rc = NGX_ERROR;
+
+        // auth and select never got a reply, the connection failure is logged already
+        if (cmd->handler == ngx_limiter_redis_auth_handler) {
+            cmd->handler = NULL;
+        }
+
+        if (cmd->handler != NULL) {
+            cmd->handler(cmd);
+        }
+
+        ngx_limiter_redis_cmd_free(cmd);
+    }
+}
+
+static void ngx_limiter_redis_write_handler(ngx_event_t* wev) {
+    ngx_uint_t n;
+    ngx_queue_t* q;
+    ngx_chain_t *out, **ll;
+    ngx_connection_t* c;
+    ngx_limiter_redis_t* redis;
+    ngx_limiter_redis_cmd_t* cmd;
+
+    c = wev->data;
+    redis = c->data;
+
+    if (wev->timedout) {
+        if (redis->connecting) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                "limiter: redis %V connect timed out", &redis->addr->name);
+
+        } else {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                "limiter: redis %V write timed out", &redis->addr->name);
+        }
+
+        ngx_limiter_redis_close(redis);
+        return;
+    }
+
+    if (redis->connecting) {
+        redis->connecting = 0;
+
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+    }
+
+    // every command queued since the last flush, whatever request it belongs to
+    n = 0;
+    out = NULL;
+    ll = &out;
+
+    for (q = ngx_queue_head(&redis->sending);
+        q != ngx_queue_sentinel(&redis->sending);
+        q = ngx_queue_next(q)) {
+
+        cmd = ngx_queue_data(q, ngx_limiter_redis_cmd_t, queue);
+
+        *ll = &cmd->out;
+        ll = &cmd->out.next;
+        n++;
+    }
+
+    *ll = NULL;
+
+    if (out != NULL) {
+        // a single writev, the rest waits for the socket to drain
+        if (c->send_chain(c, out, 0) == NGX_CHAIN_ERROR) {
+            ngx_limiter_redis_close(redis);
+            return;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+            "limiter: redis flush of %ui commands", n);
+
+        while (!ngx_queue_empty(&redis->sending)) {
+            q = ngx_queue_head(&redis->sending);
+            cmd = ngx_queue_data(q, ngx_limiter_redis_cmd_t, queue);
+
+            if (cmd->buf.pos != cmd->buf.last) {
+                break;
+            }
+
+            ngx_queue_remove(q);
+            ngx_queue_insert_tail(&redis->waiting, q);
+        }
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_limiter_redis_close(redis);
+        return;
+    }
+
+    // commands left behind by a short write wait for the socket no longer than a reply
+    if (!ngx_queue_empty(&redis->sending)) {
+        if (!wev->timer_set) {
+            ngx_add_timer(wev, redis->timeout);
+        }
+
+    } else if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    if (!ngx_queue_empty(&redis->waiting) && !c->read->timer_set) {
+        ngx_add_timer(c->read, redis->timeout);
+    }
+}
+
+static void ngx_limiter_redis_read_handler(ngx_event_t* rev) {
+    ssize_t n;
+    ngx_connection_t* c;
+    ngx_limiter_redis_t* redis;
+
+    c = rev->data;
+    redis = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+            "limiter: redis %V timed out", &redis->addr->name);
+        ngx_limiter_redis_close(redis);
+        return;
+    }
+
+    for ( ;; ) {
+
+        if (redis->last == redis->end) {
+            if (redis->pos == redis->start) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "limiter: redis %V sent too large reply", &redis->addr->name);
+                ngx_limiter_redis_close(redis);
+                return;
+            }
+
+            redis->last = ngx_movemem(redis->start, redis->pos, redis->last - redis->pos);
+            redis->pos = redis->start;
+        }
+
+        n = c->recv(c, redis->last, redis->end - redis->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            if (n == 0 && !ngx_queue_empty(&redis->waiting)) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "limiter: redis %V closed connection", &redis->addr->name);
+            }
+
+            ngx_limiter_redis_close(redis);
+            return;
+        }
+
+        redis->last += n;
+
+        if (ngx_limiter_redis_process(redis) != NGX_OK) {
+            return;
+        }
+    }
+
+    if (ngx_queue_empty(&redis->waiting)) {
+        if (rev->timer_set) {
+            ngx_del_timer(rev);
+        }
+
+    } else {
+        ngx_add_timer(rev, redis->timeout);
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_limiter_redis_close(redis);
+    }
+}
+
+// hand the complete replies to their commands, NGX_ERROR if the connection is gone
+static ngx_int_t ngx_limiter_redis_process(ngx_limiter_redis_t* redis) {
+    u_char* p;
+    ngx_int_t rc;
+    ngx_connection_t* c;
+    ngx_limiter_redis_cmd_t* cmd;
+
+    c = redis->connection;
+
+    while (redis->pos < redis->last) {
+
+        if (ngx_queue_empty(&redis->waiting)) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                "limiter: redis %V sent unexpected reply", &redis->addr->name);
+            ngx_limiter_redis_close(redis);
+            return NGX_ERROR;
+        }
+
+        cmd = ngx_queue_data(ngx_queue_head(&redis->waiting), ngx_limiter_redis_cmd_t, queue);
+
+        cmd->rc = NGX_OK;
+        cmd->nvalues = 0;
+
+        p = redis->pos;
+
+        rc = ngx_limiter_redis_parse(cmd, &p, redis->last, 0);
+
+        if (rc == NGX_AGAIN) {
+            break;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                "limiter: redis %V sent invalid reply", &redis->addr->name);
+            ngx_limiter_redis_close(redis);
+            return NGX_ERROR;
+        }
+
+        redis->pos = p;
+
+        ngx_queue_remove(&cmd->queue);
+
+        if (cmd->handler != NULL) {
+            cmd->handler(cmd);
+        }
+
+        ngx_limiter_redis_cmd_free(cmd);
+
+        // a handler failed the connection
+        if (redis->connection != c) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (redis->pos == redis->last) {
+        redis->pos = redis->start;
+        redis->last = redis->start;
+    }
+
+    return NGX_OK;
+}
+
+// parse one reply, arrays may only hold plain values
+static ngx_int_t ngx_limiter_redis_parse(ngx_limiter_redis_cmd_t* cmd,
+    u_char** pos, u_char* last, ngx_uint_t depth) {
+
+    u_char *p, *eol;
+    ngx_int_t n, i, rc, value;
+
+    p = *pos;
+
+    for (eol = p; eol + 1 < last; eol++) {
+        if (eol[0] == CR && eol[1] == LF) {
+            break;
+        }
+    }
+
+    if (eol + 1 >= last) {
+        return NGX_AGAIN;
+    }
+
+    switch (*p) {
+
+    case '+':
+        break;
+
+    case '-':
+        // the caller sends the script itself
+        if (eol - p > 8 && ngx_strncmp(p + 1, "NOSCRIPT", 8) == 0) {
+            cmd->rc = NGX_DECLINED;
+            break;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+            "limiter: redis error \"%*s\"", (size_t) (eol - p - 1), p + 1);
+        cmd->rc = NGX_ERROR;
+        break;
+
+    case ':':
+        if (ngx_limiter_redis_atoi(p + 1, eol, &value) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (cmd->nvalues < NGX_LIMITER_REDIS_VALUES) {
+            cmd->values[cmd->nvalues++] = value;
+        }
+
+        break;
+
+    case '$':
+        if (ngx_limiter_redis_atoi(p + 1, eol, &n) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        // nil
+        if (n < 0) {
+            break;
+        }
+
+        if (last - (eol + 2) < n + 2) {
+            return NGX_AGAIN;
+        }
+
+        if (ngx_limiter_redis_atoi(eol + 2, eol + 2 + n, &value) == NGX_OK
+            && cmd->nvalues < NGX_LIMITER_REDIS_VALUES) {
+            cmd->values[cmd->nvalues++] = value;
+        }
+
+        *pos = eol + 2 + n + 2;
+        return NGX_OK;
+
+    case '*':
+        if (depth > 0 || ngx_limiter_redis_atoi(p + 1, eol, &n) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        p = eol + 2;
+
+        for (i = 0; i < n; i++) {
+            rc = ngx_limiter_redis_parse(cmd, &p, last, depth + 1);
+            if (rc != NGX_OK) {
+                return rc;
+            }
+        }
+
+        *pos = p;
+        return NGX_OK;
+
+    default:
+        return NGX_ERROR;
+    }
+
+    *pos = eol + 2;
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_limiter_redis_atoi(u_char* p, u_char* last, ngx_int_t* value) {
+    ngx_int_t sign;
+
+    sign = 1;
+
+    if (p < last && *p == '-') {
+        sign = -1;
+        p++;
+    }
+
+    *value = ngx_atoi(p, last - p);
+    if (*value == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    *value *= sign;
+
+    return NGX_OK;
+}
+
+static void ngx_limiter_redis_auth_handler(ngx_limiter_redis_cmd_t* cmd) {
+    if (cmd->rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "limiter: redis auth or select failed");
+    }
+}
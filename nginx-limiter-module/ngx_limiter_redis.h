@@ -0,0 +1,107 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2023 Wuriyanto <wuriyanto48@yahoo.co.id>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef NGX_LIMITER_REDIS_H
+#define NGX_LIMITER_REDIS_H
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+#define NGX_LIMITER_REDIS_VALUES 4
+#define NGX_LIMITER_REDIS_BUFFER_SIZE 4096
+
+// room needed for one bulk string argument of len bytes
+#define NGX_LIMITER_REDIS_ARG_LEN(len) (sizeof("$\r\n\r\n") - 1 + NGX_SIZE_T_LEN + (len))
+
+typedef struct ngx_limiter_redis_s ngx_limiter_redis_t;
+typedef struct ngx_limiter_redis_cmd_s ngx_limiter_redis_cmd_t;
+
+typedef void (*ngx_limiter_redis_handler_pt) (ngx_limiter_redis_cmd_t* cmd);
+
+// non blocking redis connection of one worker, shared by every request
+// using the same backend, database, password and timeout, commands are
+// pipelined and replied in order;
+// the commands queued during an event loop iteration go out in one write
+struct ngx_limiter_redis_s {
+    ngx_queue_t queue;
+
+    ngx_addr_t* addr;
+    ngx_str_t pass;
+    ngx_uint_t db;
+    ngx_msec_t timeout;
+
+    ngx_peer_connection_t peer;
+    ngx_connection_t* connection;
+    ngx_uint_t connecting;
+
+    // commands not fully written yet, flushed from a posted write event
+    ngx_queue_t sending;
+
+    // commands written, waiting for their reply
+    ngx_queue_t waiting;
+
+    // reply buffer
+    u_char* start;
+    u_char* pos;
+    u_char* last;
+    u_char* end;
+};
+
+struct ngx_limiter_redis_cmd_s {
+    ngx_queue_t queue;
+
+    // called with the reply, NULL discards it
+    ngx_limiter_redis_handler_pt handler;
+    void* data;
+
+    // command in resp encoding, buf.pos is the part not sent yet
+    ngx_buf_t buf;
+
+    // link of the command in the chain of a flush
+    ngx_chain_t out;
+
+    // NGX_OK, NGX_DECLINED on a NOSCRIPT reply to EVALSHA,
+    // or NGX_ERROR on other error replies or a lost connection
+    ngx_int_t rc;
+
+    // integer reply, or the integers of an array reply
+    ngx_uint_t nvalues;
+    ngx_int_t values[NGX_LIMITER_REDIS_VALUES];
+};
+
+ngx_limiter_redis_t* ngx_limiter_redis_get(ngx_addr_t* addr, ngx_str_t* pass,
+    ngx_uint_t db, ngx_msec_t timeout, ngx_log_t* log);
+
+// size is the room for the arguments, see NGX_LIMITER_REDIS_ARG_LEN
+ngx_limiter_redis_cmd_t* ngx_limiter_redis_cmd_create(ngx_uint_t nargs, size_t size, ngx_log_t* log);
+void ngx_limiter_redis_cmd_arg(ngx_limiter_redis_cmd_t* cmd, u_char* data, size_t len);
+void ngx_limiter_redis_cmd_num(ngx_limiter_redis_cmd_t* cmd, ngx_uint_t n);
+void ngx_limiter_redis_cmd_free(ngx_limiter_redis_cmd_t* cmd);
+
+// queue a command, its handler is never called before this returns
+ngx_int_t ngx_limiter_redis_send(ngx_limiter_redis_t* redis, ngx_limiter_redis_cmd_t* cmd);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2023 Wuriyanto <wuriyanto48@yahoo.co.id>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+#include "ngx_limiter_core.h"
+
+struct ngx_stream_limiter_srv_conf_s {
+    // limiter enabled for this server
+    ngx_flag_t enable;
+
+    // redis and limit config, same directives as the http module
+    ngx_limiter_conf_t limiter;
+};
+
+struct ngx_stream_limiter_ctx_s {
+    ngx_stream_session_t* session;
+
+    // hit of the session, shared with the other lookups of the same key
+    ngx_limiter_waiter_t waiter;
+
+    // lookup pending in redis
+    ngx_uint_t waiting;
+};
+
+typedef struct ngx_stream_limiter_srv_conf_s ngx_stream_limiter_srv_conf_t;
+typedef struct ngx_stream_limiter_ctx_s ngx_stream_limiter_ctx_t;
+
+static void* ngx_stream_limiter_create_srv_conf(ngx_conf_t* cf);
+static char* ngx_stream_limiter_merge_srv_conf(ngx_conf_t* cf, void* parent, void* child);
+
+static char* ngx_stream_limiter(ngx_conf_t* cf, ngx_command_t* cmd, void* conf);
+static ngx_int_t ngx_stream_limiter_handler(ngx_stream_session_t* s);
+static void ngx_stream_limiter_wake(ngx_limiter_waiter_t* w);
+static void ngx_stream_limiter_cleanup(void* data);
+static ngx_int_t ngx_stream_limiter_postconf(ngx_conf_t* cf);
+
+// module directive
+static ngx_command_t ngx_stream_limiter_commands[] = {
+    {
+        ngx_string("limiter"), // directive
+        NGX_STREAM_SRV_CONF|NGX_CONF_NOARGS,
+
+        ngx_stream_limiter, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        0,
+        NULL,
+    },
+    {
+        ngx_string("limiter_redis_host"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_str_slot, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter.host),
+        NULL,
+    },
+    {
+        ngx_string("limiter_redis_port"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_str_slot, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter.port),
+        NULL,
+    },
+    {
+        ngx_string("limiter_redis_pass"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_str_slot, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter.pass),
+        NULL,
+    },
+    {
+        ngx_string("limiter_redis_db"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_num_slot, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter.db),
+        NULL,
+    },
+    {
+        ngx_string("limiter_key_prefix"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_str_slot, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter.prefix),
+        NULL,
+    },
+    {
+        ngx_string("limiter_redis_timeout"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_msec_slot, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter.timeout),
+        NULL,
+    },
+    {
+        ngx_string("limiter_max"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_num_slot, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter.max),
+        NULL,
+    },
+    {
+        ngx_string("limiter_expired"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_conf_set_num_slot, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter.limit_expired),
+        NULL,
+    },
+    {
+        ngx_string("limiter_lease"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_limiter_conf_set_lease, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter),
+        NULL,
+    },
+    {
+        ngx_string("limiter_adaptive"), // directive
+        NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE1,
+
+        ngx_limiter_conf_set_adaptive, // configuration setup function
+        NGX_STREAM_SRV_CONF_OFFSET,
+        offsetof(ngx_stream_limiter_srv_conf_t, limiter),
+        NULL,
+    },
+    ngx_null_command // command termination
+};
+
+// module context
+static ngx_stream_module_t ngx_stream_limiter_ctx = {
+    NULL, // module preconfig
+    ngx_stream_limiter_postconf, // module postconfig
+
+    NULL, // create main config
+    NULL, // init main config
+
+    ngx_stream_limiter_create_srv_conf, // create server config
+    ngx_stream_limiter_merge_srv_conf, // merge server config
+};
+
+// module definition
+ngx_module_t ngx_stream_limiter_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_limiter_ctx, // module context
+    ngx_stream_limiter_commands, // module directive
+    NGX_STREAM_MODULE, // module type
+    NULL, // init master
+    NULL, // init module
+    NULL, // init process
+    NULL, // init thread
+    NULL, // exit thread
+    NULL, // exit process
+    NULL, // init master
+    NGX_MODULE_V1_PADDING
+};
+
+// preaccess phase handler, runs once per tcp connection or udp session
+static ngx_int_t ngx_stream_limiter_handler(ngx_stream_session_t* s) {
+    ngx_int_t rc;
+
+    ngx_pool_cleanup_t* cln;
+    ngx_stream_limiter_ctx_t* ctx;
+    ngx_stream_limiter_srv_conf_t* limiter_srv_conf;
+
+    limiter_srv_conf = ngx_stream_get_module_srv_conf(s, ngx_stream_limiter_module);
+    if (!limiter_srv_conf->enable) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_limiter_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(*ctx));
+        if (ctx == NULL) {
+            return NGX_STREAM_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_stream_set_ctx(s, ctx, ngx_stream_limiter_module);
+
+        // a session closed while waiting leaves the lookup
+        cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+        if (cln == NULL) {
+            return NGX_STREAM_INTERNAL_SERVER_ERROR;
+        }
+
+        cln->handler = ngx_stream_limiter_cleanup;
+        cln->data = ctx;
+
+        ctx->session = s;
+
+        // a stream can not be held back, so there is no burst
+        ctx->waiter.burst = 0;
+        ctx->waiter.handler = ngx_stream_limiter_wake;
+        ctx->waiter.data = ctx;
+
+        rc = ngx_limiter_lookup(&limiter_srv_conf->limiter, &s->connection->addr_text,
+            &ctx->waiter, s->connection->log);
+
+        if (rc == NGX_AGAIN) {
+            ctx->waiting = 1;
+            return NGX_AGAIN;
+        }
+
+        ctx->waiter.rc = rc;
+    }
+
+    // client data may run the phases again before the lookup completes
+    if (ctx->waiting) {
+        return NGX_AGAIN;
+    }
+
+    rc = ctx->waiter.rc;
+
+    if (rc == NGX_ERROR) {
+        return NGX_STREAM_INTERNAL_SERVER_ERROR;
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+            "limiter: too many connection from \"%V\"", &s->connection->addr_text);
+        return NGX_STREAM_SERVICE_UNAVAILABLE;
+    }
+
+    return NGX_DECLINED;
+}
+
+// lookup result arrived, run the phase again to apply it
+static void ngx_stream_limiter_wake(ngx_limiter_waiter_t* w) {
+    ngx_stream_limiter_ctx_t* ctx = w->data;
+
+    ctx->waiting = 0;
+
+    ngx_stream_core_run_phases(ctx->session);
+}
+
+static void ngx_stream_limiter_cleanup(void* data) {
+    ngx_stream_limiter_ctx_t* ctx = data;
+
+    ngx_limiter_cancel(&ctx->waiter);
+}
+
+static char* ngx_stream_limiter(ngx_conf_t* cf, ngx_command_t* cmd, void* conf) {
+    ngx_stream_limiter_srv_conf_t* lscf = conf;
+
+    if (lscf->enable != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    lscf->enable = 1;
+
+    return NGX_CONF_OK;
+}
+
+// module postconfig
+static ngx_int_t ngx_stream_limiter_postconf(ngx_conf_t* cf) {
+    ngx_stream_handler_pt* h;
+    ngx_stream_core_main_conf_t* cmcf;
+
+    cmcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_STREAM_PREACCESS_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_limiter_handler;
+
+    return NGX_OK;
+}
+
+// module server create config
+static void* ngx_stream_limiter_create_srv_conf(ngx_conf_t* cf) {
+    ngx_log_debug0(NGX_LOG_INFO, cf->log, 0, "stream limiter module: create server conf");
+
+    ngx_stream_limiter_srv_conf_t* conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(*conf));
+    if (conf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    conf->enable = NGX_CONF_UNSET;
+    ngx_limiter_init_conf(&conf->limiter);
+
+    return conf;
+}
+
+// module server merge config
+static char* ngx_stream_limiter_merge_srv_conf(ngx_conf_t* cf, void* parent, void* child) {
+    ngx_stream_limiter_srv_conf_t* prev = parent;
+    ngx_stream_limiter_srv_conf_t* conf = child;
+
+    ngx_log_debug0(NGX_LOG_INFO, cf->log, 0, "stream limiter module: merge server conf");
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+
+    ngx_conf_merge_str_value(conf->limiter.prefix, prev->limiter.prefix, "limiter:stream:");
+
+    return ngx_limiter_merge_conf(cf, &conf->limiter, &prev->limiter);
+}